@@ -33,6 +33,11 @@ Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 #include <SDL2/SDL_image.h> // for IMG_Init and IMG_LoadTexture
 #include <math.h> // for atan() function
 
+// SDL_RenderGeometryRaw(), used to draw the particles, is new in SDL 2.0.18:
+#if !SDL_VERSION_ATLEAST(2, 0, 18)
+#error "sdl2b.c needs SDL 2.0.18 or newer"
+#endif
+
 #define SCREEN_WIDTH				1800
 #define SCREEN_HEIGHT				1000
 #define PI							3.14159265358979323846
@@ -41,6 +46,20 @@ Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 // AFTER a movement-key is released, reduce the movement speed for 
 // every consecutive frame by (1.0 - this amount):
 #define PLAYER_DECELERATION			0.25f
+// The particle ring holds at most this many particles; when it is full
+// the oldest particles are overwritten by new ones:
+#define PARTICLE_CAPACITY			200000
+// Every frame a particle's velocity is multiplied by this amount:
+#define PARTICLE_DRAG				0.94f
+// Muzzle flash: particles per frame while the left mouse button is held,
+// distance from blorp's center to the muzzle and spread in degrees:
+#define MUZZLE_RATE					4000
+#define MUZZLE_OFFSET				40.0f
+#define MUZZLE_SPREAD				12.0f
+// Dust: particles per frame while blorp walks off after a key release:
+#define DUST_RATE					600
+// The particle metrics in the title bar are averaged over this many frames:
+#define METRICS_FRAMES				60
 
 int moveY = 0;
 int moveX = 0;
@@ -49,6 +68,7 @@ int moveX = 0;
 typedef struct _mouse_ {
   int x;
   int y;
+  int fire;
   SDL_Texture *txtr_reticle;
 } mouse;
 
@@ -66,6 +86,48 @@ typedef struct _player_ {
   SDL_Texture *txtr_player;
 } player;
 
+// All particles live in one fixed-capacity ring. Every property has its own
+// array (structure-of-arrays), so the update loop walks through memory in
+// straight lines and the compiler can vectorize it:
+typedef struct _particles_ {
+  float x[PARTICLE_CAPACITY];
+  float y[PARTICLE_CAPACITY];
+  float speed_x[PARTICLE_CAPACITY];
+  float speed_y[PARTICLE_CAPACITY];
+  float life[PARTICLE_CAPACITY];
+  float fade[PARTICLE_CAPACITY];
+  float size[PARTICLE_CAPACITY];
+  SDL_Color color[PARTICLE_CAPACITY];
+  // New particles go in at `head'. The `window' slots starting at `tail'
+  // are the only ones that can still be alive:
+  int head;
+  int tail;
+  int window;
+  // Metrics for the last frame: `live' and `update_ms' are set by
+  // update_particles(), `draw_ms' by draw_particles():
+  int live;
+  double update_ms;
+  double draw_ms;
+} particles;
+
+// An emitter is attached to the position and angle of an entity. Particles
+// are launched from `offset' pixels in front of the entity and `side' pixels
+// to its right (90 degrees clockwise), within `spread' degrees around its
+// angle:
+typedef struct _emitter_ {
+  int *x;
+  int *y;
+  float *angle;
+  float offset;
+  float side;
+  float spread;
+  float min_speed;
+  float max_speed;
+  float fade;
+  float size;
+  SDL_Color color;
+} emitter;
+
 typedef enum _keystate_ {
   UP = 0,
   DOWN = 1
@@ -87,10 +149,25 @@ void handle_key(SDL_KeyboardEvent *keyevent, keystate updown, player *tha_playa)
   // These two functions are new since sdl2a.c:
   void blit_angled(SDL_Texture *txtr, int x, int y, float angle);
   float get_angle(int x1, int y1, int x2, int y2, SDL_Texture *texture);
+  double get_barrel_offset(SDL_Texture *texture);
+
+  // Particle system:
+  void emit_particles(particles *pool, emitter *source, int count);
+  void update_particles(particles *pool);
+  void build_particle_triangles(particles *pool, int first, int count, int out);
+  void draw_particles(particles *pool);
+  void update_effects(particles *pool, emitter *muzzle, emitter *dust, player *tha_playa, mouse *tha_mouse);
 
   SDL_Window *window = NULL;
   SDL_Renderer *renderer = NULL;
 
+  // The particle pool and its vertex buffers are too big for the stack.
+  // Positions and colors are kept apart so SDL_RenderGeometryRaw() can read
+  // them without the unused texture coordinates of SDL_Vertex:
+  particles effects;
+  float particle_xy[PARTICLE_CAPACITY * 3 * 2];
+  SDL_Color particle_colors[PARTICLE_CAPACITY * 3];
+
 int main(int argc, char *argv[]) {
   (void)argc;
   (void)argv;
@@ -131,6 +208,24 @@ int main(int argc, char *argv[]) {
   // New: Turn system mouse cursor off:
   SDL_ShowCursor(0);
 
+  // Blorp's gun and the dust kicked up while blorp walks off. The flash
+  // leaves from the barrel, which sits to the right of blorp's center. The
+  // dust is launched along dust_angle, which update_effects() points
+  // opposite to the walking direction:
+  float muzzle_side = (float)get_barrel_offset(blorp.txtr_player);
+  float dust_angle = 0.0f;
+  emitter muzzle_flash = {&blorp.x, &blorp.y, &blorp.angle, MUZZLE_OFFSET, muzzle_side, MUZZLE_SPREAD,
+                          4.0f, 14.0f, 0.08f, 3.0f, {255, 170, 60, 255}};
+  emitter footstep_dust = {&blorp.x, &blorp.y, &dust_angle, 20.0f, 0.0f, 50.0f,
+                           0.5f, 2.5f, 0.02f, 2.0f, {70, 60, 40, 255}};
+
+  // Particle timings are summed and maxed over METRICS_FRAMES frames for the
+  // title bar:
+  Uint32 frame = 0;
+  double update_sum = 0.0, update_max = 0.0;
+  double draw_sum = 0.0, draw_max = 0.0;
+  char title[160];
+
   while (1) {
     SDL_SetRenderDrawColor(renderer, 120, 144, 156, 255);
     SDL_RenderClear(renderer);
@@ -142,14 +237,35 @@ int main(int argc, char *argv[]) {
     // # Applying Game Logic #
     // Also takes the mouse movement into account:
     update_player(&blorp, &mousepointer);
+    update_effects(&effects, &muzzle_flash, &footstep_dust, &blorp, &mousepointer);
+    update_particles(&effects);
 
     // # Actuator Output Buffering #
     // Also takes texture rotation into account:
     blit_angled(blorp.txtr_player, blorp.x, blorp.y, blorp.angle);
 
+    // New: All particles in one batch, on top of blorp:
+    draw_particles(&effects);
+
     // New: Redraw mouse pointer centered on the mouse coordinates:
     blit(mousepointer.txtr_reticle, mousepointer.x, mousepointer.y, 1);
     SDL_RenderPresent(renderer);
+
+    // Show the particle metrics in the title bar about once a second:
+    update_sum += effects.update_ms;
+    draw_sum += effects.draw_ms;
+    update_max = (effects.update_ms > update_max) ? effects.update_ms : update_max;
+    draw_max = (effects.draw_ms > draw_max) ? effects.draw_ms : draw_max;
+    if (++frame % METRICS_FRAMES == 0) {
+      snprintf(title, sizeof(title),
+               "Blorp is going to F U UP! -- particles: %d, update: %.2f ms avg / %.2f ms max, draw: %.2f ms avg / %.2f ms max",
+               effects.live, update_sum / METRICS_FRAMES, update_max,
+               draw_sum / METRICS_FRAMES, draw_max);
+      SDL_SetWindowTitle(window, title);
+      update_sum = update_max = 0.0;
+      draw_sum = draw_max = 0.0;
+    }
+
     SDL_Delay(16);
   }
 
@@ -200,7 +316,8 @@ void process_input(player *tha_playa, mouse *tha_mouse) {
   }
 
   // NEW -- Read the mouse position here:
-  SDL_GetMouseState(&tha_mouse->x, &tha_mouse->y);
+  Uint32 buttons = SDL_GetMouseState(&tha_mouse->x, &tha_mouse->y);
+  tha_mouse->fire = (buttons & SDL_BUTTON(SDL_BUTTON_LEFT)) != 0;
 }
 
 
@@ -342,10 +459,6 @@ void blit_angled(SDL_Texture *txtr, int x, int y, float angle) {
 float get_angle(int x1, int y1, int x2, int y2, SDL_Texture *txtr) {
   // We Make Sure We Have Our Variables //
   double pythagoras, sinusRule, arcTangus = 0;
-  int h = 0;
-
-  // We Want To Know Where Blorp Is //
-  SDL_QueryTexture(txtr, NULL, NULL, NULL, &h);
 
   // Just To Keep Everything A Bit Organized //
   double answerA, answerB;
@@ -356,8 +469,8 @@ float get_angle(int x1, int y1, int x2, int y2, SDL_Texture *txtr) {
   pythagoras = sqrt(answerA + answerB);
 
   // After That We Use pythagoras And The Sinus Rule To Calulate Our Degree //
-  answerA = h / 3.75;
-  answerB = sin(90) / pythagoras;
+  answerA = get_barrel_offset(txtr);
+  answerB = 1 / pythagoras;
   sinusRule = asin(answerA * answerB);
 
   // Now We Calculte It's Opposite //
@@ -370,3 +483,165 @@ float get_angle(int x1, int y1, int x2, int y2, SDL_Texture *txtr) {
   answerB = 180 / PI;
   return (float)(answerA * answerB);
 }
+
+// How far the gun sits to the right of blorp's center, in pixels. Both
+// get_angle() and the muzzle flash use this, so the barrel, the flash and
+// the reticle stay on one line:
+double get_barrel_offset(SDL_Texture *txtr) {
+  int h = 0;
+  SDL_QueryTexture(txtr, NULL, NULL, NULL, &h);
+  return h / 3.75 * sin(90);
+}
+
+// Launch `count' particles from an emitter into the ring. When the ring is
+// full, the oldest particles are overwritten. get_angle() returns NaN when
+// the reticle is closer to blorp than the barrel offset, so an emitter
+// without a proper angle launches nothing:
+void emit_particles(particles *pool, emitter *source, int count) {
+  if (!isfinite(*source->angle)) {
+    return;
+  }
+
+  float radians = *source->angle * (float)(PI / 180);
+  float origin_x = *source->x + cosf(radians) * source->offset - sinf(radians) * source->side;
+  float origin_y = *source->y + sinf(radians) * source->offset + cosf(radians) * source->side;
+
+  for (int n = 0; n < count; n++) {
+    float spread = ((float)rand() / RAND_MAX - 0.5f) * source->spread * (float)(PI / 180);
+    float speed = source->min_speed + ((float)rand() / RAND_MAX) * (source->max_speed - source->min_speed);
+    int i = pool->head;
+
+    pool->x[i] = origin_x;
+    pool->y[i] = origin_y;
+    pool->speed_x[i] = cosf(radians + spread) * speed;
+    pool->speed_y[i] = sinf(radians + spread) * speed;
+    pool->life[i] = 1.0f;
+    pool->fade[i] = source->fade;
+    pool->size[i] = source->size;
+    pool->color[i] = source->color;
+
+    pool->head = (i + 1) % PARTICLE_CAPACITY;
+  }
+
+  // Once the ring is full, the oldest particle is the one after the newest:
+  pool->window += count;
+  if (pool->window >= PARTICLE_CAPACITY) {
+    pool->window = PARTICLE_CAPACITY;
+    pool->tail = pool->head;
+  }
+}
+
+// Integrate and fade every particle in the ring. The loop has no branches
+// and only touches float arrays, so the compiler turns it into SIMD code.
+// Dead particles keep a life of 0 and are simply skipped when drawing.
+// Their speed is set to exactly 0: multiplying it by PARTICLE_DRAG forever
+// would end in denormal floats, which make this loop many times slower:
+void update_particles(particles *pool) {
+  Uint64 start = SDL_GetPerformanceCounter();
+  int live = 0;
+
+  for (int i = 0; i < PARTICLE_CAPACITY; i++) {
+    float life = pool->life[i] - pool->fade[i];
+    life = life > 0.0f ? life : 0.0f;
+    float alive = life > 0.0f ? 1.0f : 0.0f;
+
+    pool->x[i] += pool->speed_x[i];
+    pool->y[i] += pool->speed_y[i];
+    pool->speed_x[i] *= PARTICLE_DRAG * alive;
+    pool->speed_y[i] *= PARTICLE_DRAG * alive;
+    pool->life[i] = life;
+  }
+
+  // Counting in a separate loop keeps both loops vectorizable:
+  for (int i = 0; i < PARTICLE_CAPACITY; i++) {
+    live += pool->life[i] > 0.0f;
+  }
+
+  // Shrink the live window past the particles that died at its old end:
+  while (pool->window > 0 && pool->life[pool->tail] <= 0.0f) {
+    pool->tail = (pool->tail + 1) % PARTICLE_CAPACITY;
+    pool->window--;
+  }
+
+  pool->live = live;
+  pool->update_ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+// Write a triangle for `count' ring slots starting at `first', into the
+// vertex buffers starting at triangle `out'. There is no branch, so the
+// compiler can vectorize it: a dead particle becomes a triangle with no
+// area and no alpha, which draws nothing:
+void build_particle_triangles(particles *pool, int first, int count, int out) {
+  float *xy = &particle_xy[out * 6];
+  SDL_Color *colors = &particle_colors[out * 3];
+
+  for (int n = 0; n < count; n++) {
+    int i = first + n;
+    float life = pool->life[i];
+    float size = life > 0.0f ? pool->size[i] : 0.0f;
+    SDL_Color color = pool->color[i];
+    color.a = (Uint8)(life * 255.0f);
+
+    xy[n * 6 + 0] = pool->x[i];
+    xy[n * 6 + 1] = pool->y[i] - size;
+    xy[n * 6 + 2] = pool->x[i] + size;
+    xy[n * 6 + 3] = pool->y[i] + size;
+    xy[n * 6 + 4] = pool->x[i] - size;
+    xy[n * 6 + 5] = pool->y[i] + size;
+    colors[n * 3 + 0] = color;
+    colors[n * 3 + 1] = color;
+    colors[n * 3 + 2] = color;
+  }
+}
+
+// Turn the live window of the ring into triangles and hand them all to the
+// renderer in a single call. A triangle instead of a quad means 3 vertices
+// instead of 4 plus 6 indices, which matters when 200k particles are
+// written every frame. Additive blending makes overlapping particles glow.
+// `draw_ms' includes SDL_RenderGeometryRaw(), which copies every vertex
+// into SDL's command queue:
+void draw_particles(particles *pool) {
+  Uint64 start = SDL_GetPerformanceCounter();
+  int count = pool->window;
+
+  // The window may wrap around the end of the ring:
+  int run = PARTICLE_CAPACITY - pool->tail;
+  run = (count < run) ? count : run;
+  build_particle_triangles(pool, pool->tail, run, 0);
+  build_particle_triangles(pool, 0, count - run, run);
+
+  if (count > 0) {
+    // Geometry without a texture uses the renderer's draw blend mode:
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
+    SDL_RenderGeometryRaw(renderer, NULL, particle_xy, 2 * sizeof(float), particle_colors, sizeof(SDL_Color),
+                          NULL, 0, count * 3, NULL, 0, 0);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+  }
+
+  pool->draw_ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+// Decide which emitters fire this frame:
+void update_effects(particles *pool, emitter *muzzle, emitter *dust, player *tha_playa, mouse *tha_mouse) {
+  // Muzzle flash leaves the barrel along blorp's angle. That angle is
+  // corrected in get_angle() so the barrel, not the center, aims at the
+  // reticle:
+  if (tha_mouse->fire) {
+    emit_particles(pool, muzzle, MUZZLE_RATE);
+  }
+
+  // Dust only while blorp walks off, i.e. while moving on an axis whose
+  // keys have been released:
+  int dust_x = 0;
+  int dust_y = 0;
+  if (moveX != 0 && !tha_playa->left && !tha_playa->right) {
+    dust_x = (moveX == 1) ? 1 : -1;
+  }
+  if (moveY != 0 && !tha_playa->up && !tha_playa->down) {
+    dust_y = (moveY == 1) ? 1 : -1;
+  }
+  if (dust_x != 0 || dust_y != 0) {
+    *dust->angle = (float)(atan2(dust_y, dust_x) * 180 / PI);
+    emit_particles(pool, dust, DUST_RATE);
+  }
+}